@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <rpcws.hpp>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <utility>
+
+// intrusive multi-producer single-consumer queue (Vyukov), never blocks the producer
+template <typename T> class mpsc_queue {
+  struct node {
+    std::atomic<node *> next{ nullptr };
+    T value;
+  };
+  std::atomic<node *> head;
+  node *tail;
+
+public:
+  mpsc_queue()
+      : head(new node)
+      , tail(head.load()) {}
+  mpsc_queue(mpsc_queue const &) = delete;
+  ~mpsc_queue() {
+    while (tail) delete std::exchange(tail, tail->next.load());
+  }
+
+  void push(T value) {
+    auto item   = new node;
+    item->value = std::move(value);
+    head.exchange(item, std::memory_order_acq_rel)->next.store(item, std::memory_order_release);
+  }
+
+  bool pop(T &value) {
+    auto next = tail->next.load(std::memory_order_acquire);
+    if (!next) return false;
+    value = std::move(next->value);
+    delete std::exchange(tail, next);
+    return true;
+  }
+};
+
+// hands tasks over to the thread running the target epoll loop
+class channel {
+  mpsc_queue<std::function<void()>> queue;
+  std::atomic<bool> pending{ false };
+  int fd;
+
+public:
+  channel(rpcws::epoll &loop)
+      : fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    if (fd == -1) throw std::runtime_error("failed to create eventfd");
+    loop.add(EPOLLIN, fd, loop.reg([this](epoll_event const &e) {
+      uint64_t x;
+      read(fd, &x, sizeof x);
+      pending.store(false);
+      std::function<void()> task;
+      while (queue.pop(task)) task();
+    }));
+  }
+  channel(channel const &) = delete;
+
+  void post(std::function<void()> task) {
+    queue.push(std::move(task));
+    if (!pending.exchange(true)) {
+      uint64_t x = 1;
+      write(fd, &x, sizeof x);
+    }
+  }
+};
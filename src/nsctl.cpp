@@ -1,11 +1,18 @@
+#include <cctype>
+#include <cerrno>
 #include <cstring>
+#include <functional>
 #include <iterator>
 #include <rpcws.hpp>
 #include <signal.h>
+#include <sstream>
 #include <sys/ioctl.h>
 #include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 #include "utils.hpp"
 
@@ -20,6 +27,14 @@ static_assert(sizeof(ptr_union) == 8);
 
 void printHelp();
 
+std::vector<std::string> split(char const *str) {
+  std::vector<std::string> ret;
+  std::istringstream iss{ str };
+  std::string item;
+  while (std::getline(iss, item, ',')) ret.emplace_back(item);
+  return ret;
+}
+
 enum struct Mode {
   unknown,
   print_help,
@@ -42,15 +57,50 @@ int main(int argc, char **argv) {
   using namespace rpcws;
 
   static Mode mode;
-  static std::string strbuf;
   static json body;
 
   if (argc == 1) {
     mode = Mode::print_help;
+  } else if (strcmp(argv[1], "status") == 0) {
+    mode = Mode::all_status;
+    body = json::object();
+    for (int i = 2; i < argc; i++) {
+      if (strncmp(argv[i], "--", 2) != 0) {
+        mode            = Mode::status;
+        body["service"] = argv[i];
+      } else if (i + 1 == argc) {
+        std::cerr << "Missing value for " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      } else if (strcmp(argv[i], "--fields") == 0)
+        body["fields"] = split(argv[++i]);
+      else if (strcmp(argv[i], "--status") == 0)
+        body["status"] = split(argv[++i]);
+      else if (strcmp(argv[i], "--name") == 0)
+        body["name"] = argv[++i];
+      else if (strcmp(argv[i], "--after") == 0)
+        body["after"] = argv[++i];
+      else if (strcmp(argv[i], "--limit") == 0) {
+        auto value = argv[++i];
+        try {
+          if (!isdigit((unsigned char)value[0])) throw std::invalid_argument(value);
+          size_t pos, limit = std::stoul(value, &pos);
+          if (value[pos] != '\0' || limit == 0) throw std::invalid_argument(value);
+          body["limit"] = limit;
+        } catch (std::exception const &) {
+          std::cerr << "Invalid limit " << value << std::endl;
+          return EXIT_FAILURE;
+        }
+      } else {
+        std::cerr << "Unknown option " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    if (mode == Mode::status && (body.contains("status") || body.contains("name") || body.contains("after") || body.contains("limit"))) {
+      std::cerr << "--status, --name, --after and --limit cannot be used with a service" << std::endl;
+      return EXIT_FAILURE;
+    }
   } else if (argc == 2) {
-    if (strcmp(argv[1], "status") == 0)
-      mode = Mode::all_status;
-    else if (strcmp(argv[1], "version") == 0)
+    if (strcmp(argv[1], "version") == 0)
       mode = Mode::print_version;
     else if (strcmp(argv[1], "log") == 0)
       mode = Mode::all_log;
@@ -59,9 +109,7 @@ int main(int argc, char **argv) {
     else if (strcmp(argv[1], "shutdown") == 0)
       mode = Mode::shutdown;
   } else if (argc == 3) {
-    if (strcmp(argv[1], "status") == 0)
-      mode = Mode::status;
-    else if (strcmp(argv[1], "stop") == 0)
+    if (strcmp(argv[1], "stop") == 0)
       mode = Mode::stop;
     else if (strcmp(argv[1], "start") == 0)
       mode = Mode::start;
@@ -82,12 +130,6 @@ int main(int argc, char **argv) {
   switch (mode) {
   case Mode::print_help: printHelp(); return EXIT_SUCCESS;
   case Mode::unknown: std::cerr << "Unknown subcommand " << argv[1] << std::endl; return EXIT_FAILURE;
-  case Mode::send: {
-    std::cin >> std::noskipws;
-    std::istream_iterator<char> it{ std::cin };
-    std::istream_iterator<char> end;
-    strbuf = { it, end };
-  } break;
   case Mode::start: {
     std::cin >> std::noskipws;
     std::istream_iterator<char> it{ std::cin };
@@ -115,6 +157,12 @@ int main(int argc, char **argv) {
     instance.stop();
     handler.shutdown();
   };
+  // opt into the binary-safe output stream, older nsgod only provides the plain text one
+  static auto on_output = [](std::function<void(json)> callback) {
+    instance.call("encoding", json::object({ { "binary", true } }))
+        .then([=](json) { instance.on("binary_output", callback).fail(do_fail); })
+        .fail([=](auto) { instance.on("output", callback).fail(do_fail); });
+  };
 
   instance.start()
       .then<promise<json>>([] { return instance.call("ping", json::object({})); })
@@ -127,21 +175,18 @@ int main(int argc, char **argv) {
           instance.call("version", json::object({})).then(do_print).then(do_close);
         } break;
         case Mode::all_log: {
-          instance
-              .on("output",
-                  [](json data) {
-                    auto tag = "[" + data["service"].get<std::string>() + "]";
-                    std::istringstream iss{ data["data"].get<std::string>() };
-                    std::string line;
-                    while (std::getline(iss, line)) std::cout << tag << line << std::endl;
-                  })
-              .fail(do_fail);
+          on_output([](json data) {
+            auto tag = "[" + data["service"].get<std::string>() + "]";
+            std::istringstream iss{ get_payload(data) };
+            std::string line;
+            while (std::getline(iss, line)) std::cout << tag << line << std::endl;
+          });
         } break;
         case Mode::all_status: {
-          instance.call("status", json::object({})).then(do_print).then(do_close).fail(do_fail);
+          instance.call("status", body).then(do_print).then(do_close).fail(do_fail);
         } break;
         case Mode::status: {
-          instance.call("status", json::object({ { "service", argv[2] } })).then(do_print).then(do_close).fail(do_fail);
+          instance.call("status", body).then(do_print).then(do_close).fail(do_fail);
         } break;
         case Mode::stop: {
           instance.call("kill", json::object({ { "service", argv[2] }, { "signal", SIGTERM }, { "restart", -1 } })).then(do_close).fail(do_fail);
@@ -153,7 +198,62 @@ int main(int argc, char **argv) {
           instance.call("erase", json::object({ { "service", argv[2] } })).then(do_print).then(do_close).fail(do_fail);
         } break;
         case Mode::send: {
-          instance.call("send", json::object({ { "service", argv[2] }, { "data", strbuf } })).then(do_print).then(do_close).fail(do_fail);
+          // stream stdin as it arrives with one request in flight, pausing whenever nsgod asks to wait until the service drained its input
+          static std::vector<char> block(0x40000);
+          static std::string partial;
+          static bool waiting = false;
+          static std::function<void()> resume;
+          static auto pump = [=] {
+            ssize_t count;
+            do count = read(STDIN_FILENO, block.data(), block.size());
+            while (count < 0 && errno == EINTR);
+            std::string data = std::exchange(partial, {});
+            if (count > 0) {
+              // keep a character cut off by the block boundary for the next block, so text stays text
+              data.append(block.data(), count);
+              auto tail = utf8_incomplete_tail(data);
+              partial   = data.substr(data.size() - tail);
+              data.resize(data.size() - tail);
+            }
+            if (data.empty()) return count > 0 ? resume() : do_close(nullptr);
+            auto request = json::object({ { "service", argv[2] } });
+            put_payload(request, data);
+            instance.call("send", request)
+                .then([=](json ret) {
+                  if (count <= 0)
+                    do_close(nullptr);
+                  else if (ret.value("wait", false))
+                    waiting = true;
+                  else
+                    resume();
+                })
+                .fail(do_fail);
+          };
+          // regular files and devices like /dev/null cannot be polled, but reading them never blocks either
+          static bool polled = [] {
+            struct stat st;
+            return fstat(STDIN_FILENO, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || isatty(STDIN_FILENO));
+          }();
+          static auto sin = handler.reg([](epoll_event const &e) {
+            handler.del(STDIN_FILENO);
+            pump();
+          });
+          resume = [] {
+            if (polled)
+              handler.add(EPOLLIN, STDIN_FILENO, sin);
+            else
+              pump();
+          };
+          instance
+              .on("drained",
+                  [=](json data) {
+                    if (waiting && data["service"] == argv[2]) {
+                      waiting = false;
+                      resume();
+                    }
+                  })
+              .fail(do_fail);
+          resume();
         } break;
         case Mode::start: {
           instance.call("start", json::object({ { "service", argv[2] }, { "options", body } })).then(do_print).then(do_close).fail(do_fail);
@@ -168,12 +268,9 @@ int main(int argc, char **argv) {
               .fail(do_fail);
         } break;
         case Mode::log: {
-          instance
-              .on("output",
-                  [=](json data) {
-                    if (data["service"] == argv[2]) std::cout << data["data"].get<std::string>() << std::flush;
-                  })
-              .fail(do_fail);
+          on_output([=](json data) {
+            if (data["service"] == argv[2]) std::cout << get_payload(data) << std::flush;
+          });
         } break;
         case Mode::attach: {
           auto update_size = [=] {
@@ -190,7 +287,9 @@ int main(int argc, char **argv) {
             }
             char buf[nread];
             read(STDIN_FILENO, buf, nread);
-            instance.call("send", { { "service", argv[2] }, { "data", std::string{ buf, (size_t)nread } } });
+            auto request = json::object({ { "service", argv[2] } });
+            put_payload(request, { buf, (size_t)nread });
+            instance.call("send", request);
           });
           handler.add(EPOLLIN, STDIN_FILENO, sin);
           auto sws = handler.reg([=](epoll_event const &e) {
@@ -215,12 +314,9 @@ int main(int argc, char **argv) {
           term.c_lflag |= IUTF8;
           tcsetattr(STDIN_FILENO, TCSAFLUSH, &term);
           update_size();
-          instance
-              .on("output",
-                  [=](json data) {
-                    if (data["service"] == argv[2]) std::cout << data["data"].get<std::string>() << std::flush;
-                  })
-              .fail(do_fail);
+          on_output([=](json data) {
+            if (data["service"] == argv[2]) std::cout << get_payload(data) << std::flush;
+          });
           instance
               .on("started",
                   [=](json data) {
@@ -245,10 +341,15 @@ void printHelp() {
   std::cout << "- shutdown                shutdown the server" << std::endl;
   std::cout << "- log [service]           monitor service's log" << std::endl;
   std::cout << "- status [service]        show runtime status of services" << std::endl;
+  std::cout << "    --fields <a,b,...>    only show these fields (pid,status,start_time,dead_time,restart,options)" << std::endl;
+  std::cout << "    --status <a,b,...>    only show services in these states (waiting,running,stoped,exited,restarting)" << std::endl;
+  std::cout << "    --name <glob>         only show services matching the pattern" << std::endl;
+  std::cout << "    --after <service>     start listing after this service" << std::endl;
+  std::cout << "    --limit <count>       show at most count services, next is the cursor for --after" << std::endl;
   std::cout << "- start <service>         start service (configuation is read from stdin)" << std::endl;
   std::cout << "- stop <service>          send SIGTERM to service" << std::endl;
   std::cout << "- kill <service> <signal> send signal (number) to service" << std::endl;
   std::cout << "- erase <service>         erase service (must be exited state)" << std::endl;
-  std::cout << "- send <service>          send text to service" << std::endl;
+  std::cout << "- send <service>          send stdin to service" << std::endl;
   std::cout << "- attach <service>        attach to service" << std::endl;
 }
\ No newline at end of file
@@ -1,6 +1,13 @@
+#include <algorithm>
+#include <atomic>
 #include <csignal>
+#include <deque>
+#include <fnmatch.h>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <rpcws.hpp>
 #include <signal.h>
 #include <stropts.h>
@@ -8,65 +15,250 @@
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "channel.hpp"
 #include "process.h"
 #include "utils.hpp"
 
 LOAD_ENV(NSGOD_API, "ws+unix://nsgod.socket");
 LOAD_ENV(NSGOD_LOCK, "nsgod.lock");
+LOAD_ENV(NSGOD_OUTPUT_BUDGET, "65536");
+LOAD_ENV(NSGOD_INPUT_LIMIT, "1048576");
+LOAD_ENV(NSGOD_OUTPUT_BACKLOG, "4194304");
+
+struct Pipe {
+  // tells a pipe apart from a later one that reused its fd number
+  uint64_t serial;
+  std::string service;
+  int log;
+  // start of a utf-8 character cut off by the previous read, completed by the next one
+  std::string partial;
+  // pending send payloads, written out whenever the fd is writable
+  std::deque<std::string> input;
+  size_t offset, queued;
+  bool watching, blocked;
+  // output bytes handed to the main loop and not yet emitted, reading is paused while it is over the backlog cap
+  size_t posted;
+  bool paused;
+  uint32_t events;
+};
 
 std::map<std::string, ProcessInfo> status_map;
-std::map<int, std::string> fdmap;
+std::map<int, Pipe> fdmap;
 std::map<int, std::string> pidmap;
+// state_lock guards status_map and pidmap, pipe_lock guards fdmap and pipe_serial; take state_lock first when both are needed
+std::mutex state_lock, pipe_lock;
+uint64_t pipe_serial;
+
+// set while an updated broadcast is queued, so a burst of SIGCHLDs is answered with a single snapshot
+std::atomic<bool> update_pending;
+
+// clients that asked for binary_output, only touched on the main thread
+std::vector<std::weak_ptr<void>> binary_clients;
+
+bool has_binary_clients() {
+  binary_clients.erase(std::remove_if(binary_clients.begin(), binary_clients.end(), [](auto &client) { return client.expired(); }),
+                       binary_clients.end());
+  return !binary_clients.empty();
+}
+
+rpc::json snapshot() {
+  update_pending = false;
+  std::vector<std::pair<std::string, ProcessSummary>> copy;
+  {
+    std::lock_guard guard{ state_lock };
+    for (auto &[name, info] : status_map) copy.emplace_back(name, summarize(info));
+  }
+  rpc::json ret = rpc::json::object();
+  for (auto &[name, info] : copy) ret[name] = info;
+  return ret;
+}
 
 int main() {
   using namespace rpcws;
   try {
+    // validated before init() sends stderr to /dev/null, so a bad value is reported to whoever started nsgod
+    static const size_t input_limit    = parse_size("NSGOD_INPUT_LIMIT", NSGOD_INPUT_LIMIT);
+    static const size_t output_budget  = parse_size("NSGOD_OUTPUT_BUDGET", NSGOD_OUTPUT_BUDGET);
+    static const size_t output_backlog = parse_size("NSGOD_OUTPUT_BACKLOG", NSGOD_OUTPUT_BACKLOG);
     int ev = init(getenv("NSGOD_DEBUG"));
     lockfile(NSGOD_LOCK);
+
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGINT);
+    sigaddset(&ss, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &ss, nullptr);
+
+    // rpc clients are served on the main thread, children and signals are handled by the supervisor thread
     auto ep = std::make_shared<epoll>();
     static RPC instance{ std::make_unique<server_wsio>(NSGOD_API, ep) };
     static auto &handler = *ep;
+    auto sp                 = std::make_shared<epoll>();
+    static auto &supervisor = *sp;
+    static channel control{ handler };
+    static channel monitor{ supervisor };
+    static auto emit = [](std::string name, json data) { control.post([=] { instance.emit(name, data); }); };
+    static std::function<void(int)> flush;
+    static std::function<void(int, Pipe &)> rearm;
 
-    static auto subproc = handler.reg([](epoll_event const &e) {
-      static char buffer[0xFFFF];
-      if (e.events & EPOLLERR || e.events & EPOLLHUP) {
-        handler.del(e.data.fd);
-        fdmap.erase(e.data.fd);
-        close(e.data.fd);
-        auto srv = fdmap[e.data.fd];
-        if (auto it = status_map.find(srv); it != status_map.end()) {
-          auto &status = it->second;
-          if (status.log) close(status.log);
+    // output fds are owned by the pump until they reach EOF, even if the service was restarted or erased in between
+    // the fd number is only closed after every table stopped referring to it, so it cannot be reused while still mapped
+    static auto release = [](int fd) {
+      {
+        std::lock_guard guard{ state_lock };
+        std::lock_guard pipe_guard{ pipe_lock };
+        if (auto it = fdmap.find(fd); it != fdmap.end()) {
+          if (it->second.events) supervisor.del(fd);
+          if (auto srv = status_map.find(it->second.service); srv != status_map.end() && srv->second.fd == fd) srv->second.fd = -1;
+          if (it->second.log) close(it->second.log);
+          if (it->second.blocked) emit("drained", json::object({ { "service", it->second.service } }));
+          fdmap.erase(it);
         }
-        return;
       }
+      close(fd);
+    };
 
-      ssize_t count = read(e.data.fd, buffer, sizeof buffer);
-      std::string_view data{ buffer, (size_t)count };
-      auto srv = fdmap[e.data.fd];
-      if (auto it = status_map.find(srv); it != status_map.end()) {
-        auto &status = it->second;
-        if (status.log) write(status.log, buffer, count);
-        instance.emit("output", json::object({ { "service", srv }, { "data", std::string{ buffer, (size_t)count } } }));
+    // the main loop emitted a chunk, reading resumes once the backlog dropped to half of the cap
+    static auto credit = [](int fd, uint64_t serial, size_t size) {
+      std::lock_guard guard{ pipe_lock };
+      auto it = fdmap.find(fd);
+      if (it == fdmap.end() || it->second.serial != serial) return;
+      auto &pipe = it->second;
+      pipe.posted -= size;
+      if (pipe.paused && pipe.posted <= output_backlog / 2) {
+        pipe.paused = false;
+        rearm(fd, pipe);
+      }
+    };
+
+    // level-triggered and non-blocking: each wakeup drains at most one budget, the rest waits for the next round
+    static auto subproc = supervisor.reg([](epoll_event const &e) {
+      static std::vector<char> buffer(output_budget);
+      if (e.events & EPOLLOUT) flush(e.data.fd);
+      if (!(e.events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+      size_t size = 0;
+      bool eof    = false;
+      while (size < buffer.size()) {
+        ssize_t count = read(e.data.fd, buffer.data() + size, buffer.size() - size);
+        if (count > 0)
+          size += count;
+        else if (count == -1 && errno == EINTR)
+          continue;
+        else {
+          eof = count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+          break;
+        }
+      }
+      std::string srv, data;
+      int log         = 0;
+      uint64_t serial = 0;
+      {
+        std::lock_guard guard{ pipe_lock };
+        if (auto it = fdmap.find(e.data.fd); it != fdmap.end()) {
+          auto &pipe = it->second;
+          srv = pipe.service, log = pipe.log;
+          data = std::exchange(pipe.partial, {});
+          data.append(buffer.data(), size);
+          // only a read cut off by the budget holds back a split character: the rest of it is already waiting in the fd,
+          // while after EAGAIN the bytes are flushed as they are so binary_output never sits on them
+          if (!eof && size == buffer.size()) {
+            auto tail    = utf8_incomplete_tail(data);
+            pipe.partial = data.substr(data.size() - tail);
+            data.resize(data.size() - tail);
+          }
+          serial = pipe.serial;
+          pipe.posted += data.size();
+          if (!eof && pipe.posted > output_backlog) {
+            pipe.paused = true;
+            rearm(e.data.fd, pipe);
+          }
+        }
+      }
+      if (log && size) write(log, buffer.data(), size);
+      // output is plain text for every client, binary_output carries the exact bytes for clients that opted in
+      if (!data.empty()) {
+        control.post([srv, data, fd = e.data.fd, serial] {
+          std::string text;
+          bool invalid = sanitize_utf8(data, text);
+          auto event   = json::object({ { "service", srv }, { "data", invalid ? text : data } });
+          if (has_binary_clients()) {
+            if (invalid)
+              instance.emit("binary_output", json::object({ { "service", srv }, { "data", base64_encode(data) }, { "encoding", "base64" } }));
+            else
+              instance.emit("binary_output", event);
+          }
+          instance.emit("output", std::move(event));
+          monitor.post([=, size = data.size()] { credit(fd, serial, size); });
+        });
       }
+      if (eof) release(e.data.fd);
     });
 
+    // runs on the supervisor thread, only watches EPOLLOUT while there is something left to write
+    flush = [](int fd) {
+      std::lock_guard guard{ pipe_lock };
+      auto it = fdmap.find(fd);
+      if (it == fdmap.end()) return;
+      auto &pipe = it->second;
+      while (!pipe.input.empty()) {
+        auto &chunk   = pipe.input.front();
+        ssize_t count = write(fd, chunk.data() + pipe.offset, chunk.size() - pipe.offset);
+        if (count < 0) {
+          if (errno == EINTR) continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            pipe.input.clear();
+            pipe.offset = pipe.queued = 0;
+          }
+          break;
+        }
+        pipe.offset += count;
+        pipe.queued -= count;
+        if (pipe.offset == chunk.size()) {
+          pipe.input.pop_front();
+          pipe.offset = 0;
+        }
+      }
+      pipe.watching = !pipe.input.empty();
+      rearm(fd, pipe);
+      if (pipe.blocked && pipe.queued <= input_limit / 2) {
+        pipe.blocked = false;
+        emit("drained", json::object({ { "service", pipe.service } }));
+      }
+    };
+
+    // registers the fd for what its pipe needs right now; a paused pipe is not watched at all, since HUP would still be reported
+    rearm = [](int fd, Pipe &pipe) {
+      uint32_t events = pipe.paused ? 0 : pipe.watching ? EPOLLIN | EPOLLOUT : EPOLLIN;
+      if (events == pipe.events) return;
+      if (pipe.events) supervisor.del(fd);
+      if (events) supervisor.add(events, fd, subproc);
+      pipe.events = events;
+    };
+
     instance.event("output");
+    instance.event("binary_output");
     instance.event("started");
     instance.event("stopped");
     instance.event("updated");
+    instance.event("drained");
 
     instance.reg("ping", [](auto client, json data) -> json { return data; });
+    instance.reg("encoding", [](auto client, json data) -> json {
+      if (data.value("binary", false)) binary_clients.emplace_back(client);
+      return json::object({ { "binary", data.value("binary", false) } });
+    });
     instance.reg("version", [](auto client, json data) -> json { return "v0.1.0"; });
     instance.reg("start", [&](auto client, json data) -> json {
       ProcessLaunchOptions opts;
       auto name = data["service"].get<std::string>();
       data["options"].get_to(opts);
+      std::lock_guard guard{ state_lock };
       if (auto it = status_map.find(name); it != status_map.end()) {
         if (it->second.status == ProcessStatus::Exited) {
-          handler.del(it->second.fd);
-          fdmap.erase(it->second.fd);
           pidmap.erase(it->second.pid);
           status_map.erase(it);
         } else
@@ -74,25 +266,43 @@ int main() {
       }
       auto proc = createProcess(opts);
       status_map.emplace(name, proc);
-      fdmap[proc.fd]   = name;
       pidmap[proc.pid] = name;
-      handler.add(EPOLLIN, proc.fd, subproc);
+      {
+        std::lock_guard pipe_guard{ pipe_lock };
+        fdmap[proc.fd] = { ++pipe_serial, name, proc.log };
+      }
+      monitor.post([fd = proc.fd] {
+        std::lock_guard guard{ pipe_lock };
+        if (auto it = fdmap.find(fd); it != fdmap.end()) rearm(fd, it->second);
+      });
       return proc;
     });
     instance.reg("send", [&](auto client, json data) -> json {
       auto name    = data["service"].get<std::string>();
-      auto content = data["data"].get<std::string>();
+      auto content = get_payload(data);
+      std::lock_guard guard{ state_lock };
       if (auto it = status_map.find(name); it != status_map.end()) {
         if (it->second.status == ProcessStatus::Exited) throw std::runtime_error("target service exited.");
-        write(it->second.fd, content.data(), content.size());
-        return json::object({ { name, "ok" } });
+        std::lock_guard pipe_guard{ pipe_lock };
+        auto pit = fdmap.find(it->second.fd);
+        if (pit == fdmap.end() || pit->second.service != name) throw std::runtime_error("target service closed its input.");
+        auto &pipe = pit->second;
+        // the cap only applies on top of an existing backlog, a single payload of any size is still accepted into an empty queue
+        if (!pipe.input.empty() && pipe.queued + content.size() > 2 * input_limit) throw std::runtime_error("target service input queue is full.");
+        if (pipe.input.empty()) monitor.post([fd = it->second.fd] { flush(fd); });
+        pipe.queued += content.size();
+        pipe.input.emplace_back(std::move(content));
+        if (pipe.queued >= input_limit) pipe.blocked = true;
+        return json::object({ { name, "ok" }, { "queued", pipe.queued }, { "wait", pipe.blocked } });
       } else
         throw std::runtime_error("target service not exists.");
     });
     instance.reg("resize", [&](auto client, json data) -> json {
       auto name = data["service"].get<std::string>();
+      std::lock_guard guard{ state_lock };
       if (auto it = status_map.find(name); it != status_map.end()) {
         if (it->second.status == ProcessStatus::Exited) throw std::runtime_error("target service exited.");
+        if (it->second.fd == -1) throw std::runtime_error("target service closed its terminal.");
         winsize ws;
         ioctl(it->second.fd, TIOCGWINSZ, &ws);
         ws.ws_col = data.value("column", ws.ws_col);
@@ -104,10 +314,9 @@ int main() {
     });
     instance.reg("erase", [&](auto client, json data) -> json {
       auto name = data["service"].get<std::string>();
+      std::lock_guard guard{ state_lock };
       if (auto it = status_map.find(name); it != status_map.end()) {
         if (it->second.status != ProcessStatus::Exited) throw std::runtime_error("target service not exited.");
-        handler.del(it->second.fd);
-        fdmap.erase(it->second.fd);
         pidmap.erase(it->second.pid);
         status_map.erase(it);
         return json::object({ { name, "ok" } });
@@ -115,18 +324,53 @@ int main() {
         throw std::runtime_error("target service not exists.");
     });
     instance.reg("status", [](auto client, json data) -> json {
+      auto fields = data.value("fields", std::vector<std::string>{});
       if (data.contains("service")) {
+        for (auto key : { "status", "name", "after", "limit" })
+          if (data.contains(key)) throw std::runtime_error(std::string(key) + " cannot be used with service.");
         auto name = data["service"].get<std::string>();
-        if (status_map.find(name) == status_map.end()) throw std::runtime_error("target service not exists.");
-        return status_map[name];
-      } else {
-        return status_map;
+        ProcessSummary info;
+        {
+          std::lock_guard guard{ state_lock };
+          if (auto it = status_map.find(name); it == status_map.end())
+            throw std::runtime_error("target service not exists.");
+          else
+            info = summarize(it->second);
+        }
+        return project(info, fields);
+      }
+      std::vector<ProcessStatus> filter;
+      for (auto &status : data.value("status", std::vector<std::string>{})) filter.push_back(parse_status(status));
+      auto glob  = data.value("name", std::string{});
+      auto after = data.value("after", std::string{});
+      auto paged = data.contains("limit");
+      if (paged && (!data["limit"].is_number_integer() || data["limit"].get<int64_t>() <= 0)) throw std::runtime_error("limit must be a positive integer.");
+      auto limit = data.value("limit", std::numeric_limits<size_t>::max());
+      std::vector<std::pair<std::string, ProcessSummary>> selected;
+      json next = nullptr;
+      {
+        std::lock_guard guard{ state_lock };
+        for (auto it = after.empty() ? status_map.begin() : status_map.upper_bound(after); it != status_map.end(); ++it) {
+          if (!filter.empty() && std::find(filter.begin(), filter.end(), it->second.status) == filter.end()) continue;
+          if (!glob.empty() && fnmatch(glob.c_str(), it->first.c_str(), 0) != 0) continue;
+          if (selected.size() == limit) {
+            next = selected.back().first;
+            break;
+          }
+          selected.emplace_back(it->first, summarize(it->second));
+        }
       }
+      json services = json::object();
+      for (auto &[name, info] : selected) services[name] = project(info, fields);
+      // a page reply carries the cursor for the following page, null once the listing is complete
+      if (paged) return json::object({ { "services", services }, { "next", next } });
+      return services;
     });
     instance.reg("kill", [](auto client, json data) -> json {
       auto name    = data["service"].get<std::string>();
       auto sig     = data["signal"].get<int>();
       auto restart = data.value("restart", RestartMode::Normal);
+      std::lock_guard guard{ state_lock };
       if (auto it = status_map.find(name); it == status_map.end())
         throw std::runtime_error("target service not exists.");
       else {
@@ -147,30 +391,29 @@ int main() {
     }
 
     {
-      sigset_t ss;
-      sigemptyset(&ss);
-      sigaddset(&ss, SIGINT);
-      sigaddset(&ss, SIGCHLD);
-      sigprocmask(SIG_BLOCK, &ss, nullptr);
       auto sfd = signalfd(-1, &ss, SFD_CLOEXEC);
-      handler.add(EPOLLIN, sfd, handler.reg([=](epoll_event const &e) {
+      supervisor.add(EPOLLIN, sfd, supervisor.reg([=](epoll_event const &e) {
         signalfd_siginfo info;
         read(e.data.fd, &info, sizeof info);
         switch (info.ssi_signo) {
         case SIGINT: {
-          instance.stop();
-          handler.shutdown();
+          control.post([] {
+            instance.stop();
+            handler.shutdown();
+          });
+          supervisor.shutdown();
         } break;
         case SIGCHLD: {
           int wstatus;
           auto pid = waitpid(WAIT_ANY, &wstatus, WNOHANG | WUNTRACED | WCONTINUED);
           if (pid <= 0) return;
+          std::lock_guard guard{ state_lock };
           auto service = pidmap[pid];
           auto &info   = status_map[service];
           if (WIFSTOPPED(wstatus)) {
             if (info.options.waitstop && info.status == ProcessStatus::Waiting) {
               kill(pid, SIGCONT);
-              instance.emit("started", json::object({ { "service", service } }));
+              emit("started", json::object({ { "service", service } }));
               info.status = ProcessStatus::Running;
             } else
               info.status = ProcessStatus::Stopped;
@@ -181,58 +424,60 @@ int main() {
             auto last      = info.dead_time;
             info.dead_time = std::chrono::system_clock::now();
             pidmap.erase(pid);
-            close(info.log);
             if (info.restart_mode == RestartMode::Force || info.options.restart.enabled) {
               if (info.restart_mode == RestartMode::Normal && info.dead_time - last > info.options.restart.reset_timer) { info.restart = 0; }
               if (info.restart_mode == RestartMode::Prevent ||
                   (info.restart_mode == RestartMode::Normal && info.restart++ >= info.options.restart.max)) {
-                instance.emit("stopped", json::object({
-                                             { "service", service },
-                                             { "restart", json::object({
-                                                              { "error", "max" },
-                                                          }) },
-                                         }));
+                emit("stopped", json::object({
+                                    { "service", service },
+                                    { "restart", json::object({
+                                                     { "error", "max" },
+                                                 }) },
+                                }));
               } else {
                 info.restart_mode = RestartMode::Normal;
                 try {
                   auto proc = createProcess(info.options);
-                  handler.del(info.fd);
-                  fdmap.erase(info.fd);
                   info.fd          = proc.fd;
                   info.pid         = proc.pid;
                   info.start_time  = proc.start_time;
                   info.status      = proc.status;
                   info.log         = proc.log;
-                  fdmap[proc.fd]   = service;
                   pidmap[proc.pid] = service;
-                  handler.add(EPOLLIN, proc.fd, subproc);
-                  instance.emit("stopped", json::object({
-                                               { "service", service },
-                                               { "restart", json::object({
-                                                                { "max", info.options.restart.max },
-                                                                { "current", info.restart },
-                                                            }) },
-                                           }));
+                  {
+                    std::lock_guard pipe_guard{ pipe_lock };
+                    auto &pipe = fdmap[proc.fd] = { ++pipe_serial, service, proc.log };
+                    rearm(proc.fd, pipe);
+                  }
+                  emit("stopped", json::object({
+                                      { "service", service },
+                                      { "restart", json::object({
+                                                       { "max", info.options.restart.max },
+                                                       { "current", info.restart },
+                                                   }) },
+                                  }));
                 } catch (std::exception &x) {
-                  instance.emit("stopped", json::object({
-                                               { "service", service },
-                                               { "restart", json::object({
-                                                                { "error", "failed to restart" },
-                                                            }) },
-                                           }));
+                  emit("stopped", json::object({
+                                      { "service", service },
+                                      { "restart", json::object({
+                                                       { "error", "failed to restart" },
+                                                   }) },
+                                  }));
                 }
               }
             } else {
-              instance.emit("stopped", json::object({ { "service", service } }));
+              emit("stopped", json::object({ { "service", service } }));
             }
           }
-          instance.emit("updated", status_map);
+          if (!update_pending.exchange(true)) control.post([] { instance.emit("updated", snapshot()); });
         } break;
         }
       }));
     }
 
+    std::thread worker{ [] { supervisor.wait(); } };
     instance.start();
     handler.wait();
+    worker.join();
   } catch (std::runtime_error &e) { std::cerr << e.what() << std::endl; }
 }
\ No newline at end of file
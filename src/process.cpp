@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <filesystem>
 #include <pty.h>
+#include <sstream>
 #include <sys/eventfd.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
@@ -70,30 +71,62 @@ int init(bool debug) {
   return ev;
 }
 
-char *const *buildv(std::vector<std::string> &vec) {
-  auto ret = new char *[vec.size() + 1];
-  size_t i = 0;
-  for (auto &item : vec) ret[i++] = item.data();
-  ret[i] = nullptr;
+// everything the child touches is prepared before fork: another thread may hold the malloc lock at that moment,
+// so between fork and exec the child only makes async-signal-safe calls
+struct LaunchPlan {
+  std::vector<std::pair<std::string, std::string>> mounts;
+  std::string root, cwd;
+  std::vector<std::string> candidates;
+  std::vector<char *> argv, envp;
+};
+
+std::vector<char *> buildv(std::vector<std::string> &vec) {
+  std::vector<char *> ret;
+  for (auto &item : vec) ret.push_back(item.data());
+  ret.push_back(nullptr);
   return ret;
 }
 
-inline __attribute__((always_inline)) void setup_env(ProcessLaunchOptions const &options) {
+LaunchPlan prepare(ProcessLaunchOptions &options) {
+  if (options.cmdline.empty()) throw std::runtime_error("cmdline is empty");
+  LaunchPlan ret;
   auto root = fs::path{ options.root };
-  for (auto &[k, v] : options.mounts) {
-    auto src = root / k;
-    auto tgt = fs::path{ v };
-    mount(tgt.c_str(), src.c_str(), "tmpfs", MS_BIND | MS_REC, nullptr);
+  for (auto &[k, v] : options.mounts) ret.mounts.emplace_back(v, (root / k).string());
+  ret.root  = root.string();
+  ret.cwd   = options.cwd;
+  auto file = options.cmdline[0];
+  if (file.find('/') != std::string::npos)
+    ret.candidates.push_back(file);
+  else {
+    // same search as execvp (nsgod's own PATH), tried inside the new root after chroot
+    auto path = getenv("PATH");
+    std::istringstream iss{ path ? path : "/bin:/usr/bin" };
+    std::string dir;
+    while (std::getline(iss, dir, ':')) ret.candidates.push_back((dir.empty() ? "." : dir) + "/" + file);
   }
-  chroot(root.c_str());
-  chdir(options.cwd.c_str());
+  ret.argv = buildv(options.cmdline);
+  ret.envp = buildv(options.env);
+  return ret;
+}
+
+[[noreturn]] void launch(LaunchPlan const &plan) {
+  for (auto &[src, tgt] : plan.mounts) mount(src.c_str(), tgt.c_str(), "tmpfs", MS_BIND | MS_REC, nullptr);
+  chroot(plan.root.c_str());
+  chdir(plan.cwd.c_str());
+  for (auto &candidate : plan.candidates) {
+    execve(candidate.c_str(), plan.argv.data(), plan.envp.data());
+    if (errno != ENOENT && errno != ENOTDIR && errno != EACCES) break;
+  }
+  _exit(-1);
 }
 
 ProcessInfo createProcess(ProcessLaunchOptions options) {
   ProcessInfo ret{
-    .start_time = std::chrono::system_clock::now(),
-    .options    = options,
+    .start_time   = std::chrono::system_clock::now(),
+    .options      = options,
+    .options_json = std::make_shared<const rpc::json>(options),
   };
+  auto plan = prepare(options);
   if (!options.log.empty()) {
     ret.log = open64(options.log.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC | O_CREAT, 0600);
     if (ret.log == -1) throw std::runtime_error("failed to open log file");
@@ -101,14 +134,7 @@ ProcessInfo createProcess(ProcessLaunchOptions options) {
   if (options.pty) {
     auto pid = forkpty(&ret.fd, nullptr, nullptr, nullptr);
     if (pid < 0) throw std::runtime_error("failed to fork");
-    if (pid == 0) {
-      setup_env(options);
-
-      auto argv = buildv(options.cmdline);
-      auto envp = buildv(options.env);
-
-      _exit(execvpe(argv[0], argv, envp));
-    }
+    if (pid == 0) launch(plan);
     ret.pid    = pid;
     ret.status = options.waitstop ? ProcessStatus::Waiting : ProcessStatus::Running;
   } else {
@@ -122,17 +148,13 @@ ProcessInfo createProcess(ProcessLaunchOptions options) {
       dup2(fds[1], 1);
       dup2(fds[1], 2);
       close(fds[1]);
-      setup_env(options);
-
-      auto argv = buildv(options.cmdline);
-      auto envp = buildv(options.env);
-
-      _exit(execvpe(argv[0], argv, envp));
+      launch(plan);
     }
     close(fds[1]);
     ret.pid    = pid;
     ret.status = options.waitstop ? ProcessStatus::Waiting : ProcessStatus::Running;
     ret.fd     = fds[0];
   }
+  fcntl(ret.fd, F_SETFL, fcntl(ret.fd, F_GETFL) | O_NONBLOCK);
   return ret;
 }
\ No newline at end of file
@@ -24,6 +24,14 @@ NLOHMANN_JSON_SERIALIZE_ENUM(ProcessStatus, {
                                                 { ProcessStatus::Restarting, "restarting" },
                                             });
 
+// strict counterpart of the enum serializer above, which silently maps unknown names to Waiting
+inline ProcessStatus parse_status(std::string const &name) {
+  for (auto status : { ProcessStatus::Waiting, ProcessStatus::Running, ProcessStatus::Stopped, ProcessStatus::Exited, ProcessStatus::Restarting })
+    if (rpc::json(status) == name) return status;
+  if (name == "stopped") return ProcessStatus::Stopped;
+  throw std::runtime_error("unknown status " + name);
+}
+
 enum struct RestartMode { Normal, Force, Prevent };
 
 NLOHMANN_JSON_SERIALIZE_ENUM(RestartMode, {
@@ -54,6 +62,18 @@ struct ProcessInfo {
   std::chrono::system_clock::time_point start_time, dead_time;
   ProcessLaunchOptions options;
   int fd, log;
+  // options never change after start, so their json tree is built once and copied into replies; wsrpc only takes
+  // json values, so the encoded bytes themselves cannot be reused and every message still pays for the copy and dump
+  std::shared_ptr<const rpc::json> options_json;
+};
+
+// the serializable part of a ProcessInfo, cheap to copy out from under the lock
+struct ProcessSummary {
+  pid_t pid;
+  ProcessStatus status;
+  int restart;
+  std::chrono::system_clock::time_point start_time, dead_time;
+  std::shared_ptr<const rpc::json> options;
 };
 
 struct ProcessInfoClient {
@@ -114,13 +134,41 @@ inline void from_json(const rpc::json &j, ProcessLaunchOptions &i) {
   i.restart  = j.value("restart", RestartPolicy{ false, 0, 0ms });
 }
 
-inline void to_json(rpc::json &j, const ProcessInfo &i) {
+inline ProcessSummary summarize(const ProcessInfo &i) {
+  return { i.pid, i.status, i.restart, i.start_time, i.dead_time, i.options_json ? i.options_json : std::make_shared<const rpc::json>(i.options) };
+}
+
+inline void to_json(rpc::json &j, const ProcessSummary &i) {
   j["pid"]        = i.pid;
   j["status"]     = i.status;
   j["start_time"] = i.start_time;
   j["dead_time"]  = i.dead_time;
   j["restart"]    = i.restart;
-  j["options"]    = i.options;
+  j["options"]    = *i.options;
+}
+
+inline void to_json(rpc::json &j, const ProcessInfo &i) { j = summarize(i); }
+
+inline rpc::json project(const ProcessSummary &i, std::vector<std::string> const &fields) {
+  if (fields.empty()) return i;
+  rpc::json j = rpc::json::object();
+  for (auto &field : fields) {
+    if (field == "pid")
+      j["pid"] = i.pid;
+    else if (field == "status")
+      j["status"] = i.status;
+    else if (field == "start_time")
+      j["start_time"] = i.start_time;
+    else if (field == "dead_time")
+      j["dead_time"] = i.dead_time;
+    else if (field == "restart")
+      j["restart"] = i.restart;
+    else if (field == "options")
+      j["options"] = *i.options;
+    else
+      throw std::runtime_error("unknown field " + field);
+  }
+  return j;
 }
 
 inline void from_json(rpc::json const &j, ProcessInfoClient &i) {
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <array>
+#include <cctype>
+#include <cstdint>
 #include <fcntl.h>
+#include <rpc.hpp>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 
 std::string GetEnvironmentVariableOrDefault(const std::string &variable_name, const std::string &default_value) {
   const char *value = getenv(variable_name.c_str());
@@ -20,4 +26,146 @@ void lockfile(std::string const &name) {
     perror("creat(lock)");
     abort();
   }
-}
\ No newline at end of file
+}
+size_t parse_size(char const *name, std::string const &value) {
+  try {
+    size_t pos;
+    if (!value.empty() && isdigit((unsigned char)value[0])) {
+      auto ret = std::stoull(value, &pos);
+      if (pos == value.size() && ret > 0) return ret;
+    }
+  } catch (std::exception const &) {}
+  throw std::runtime_error(std::string("invalid ") + name + ": " + value);
+}
+
+static char const base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64_encode(std::string_view input) {
+  std::string ret;
+  ret.reserve((input.size() + 2) / 3 * 4);
+  auto src = (unsigned char const *)input.data();
+  size_t i = 0;
+  for (; i + 2 < input.size(); i += 3) {
+    uint32_t n = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+    ret += base64_table[n >> 18 & 63];
+    ret += base64_table[n >> 12 & 63];
+    ret += base64_table[n >> 6 & 63];
+    ret += base64_table[n & 63];
+  }
+  if (auto rest = input.size() - i; rest) {
+    uint32_t n = src[i] << 16 | (rest == 2 ? src[i + 1] << 8 : 0);
+    ret += base64_table[n >> 18 & 63];
+    ret += base64_table[n >> 12 & 63];
+    ret += rest == 2 ? base64_table[n >> 6 & 63] : '=';
+    ret += '=';
+  }
+  return ret;
+}
+
+std::string base64_decode(std::string_view input) {
+  static auto const table = [] {
+    std::array<int8_t, 256> ret;
+    ret.fill(-1);
+    for (int i = 0; i < 64; i++) ret[(unsigned char)base64_table[i]] = i;
+    return ret;
+  }();
+  std::string ret;
+  ret.reserve(input.size() / 4 * 3);
+  uint32_t n = 0;
+  int bits   = 0;
+  for (unsigned char ch : input) {
+    if (ch == '=') break;
+    if (table[ch] == -1) throw std::runtime_error("invalid base64 payload");
+    n = n << 6 | table[ch];
+    if ((bits += 6) >= 8) {
+      bits -= 8;
+      ret += (char)(n >> bits & 0xFF);
+    }
+  }
+  return ret;
+}
+
+// length of the well-formed utf-8 sequence starting at it, 0 if it is malformed or cut off by end
+size_t utf8_sequence(unsigned char const *it, unsigned char const *end) {
+  if (*it < 0x80) return 1;
+  size_t len;
+  uint32_t cp;
+  if ((*it & 0xE0) == 0xC0)
+    len = 2, cp = *it & 0x1F;
+  else if ((*it & 0xF0) == 0xE0)
+    len = 3, cp = *it & 0x0F;
+  else if ((*it & 0xF8) == 0xF0)
+    len = 4, cp = *it & 0x07;
+  else
+    return 0;
+  if ((size_t)(end - it) < len) return 0;
+  for (size_t i = 1; i < len; i++) {
+    if ((it[i] & 0xC0) != 0x80) return 0;
+    cp = cp << 6 | (it[i] & 0x3F);
+  }
+  if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) || (len == 4 && (cp < 0x10000 || cp > 0x10FFFF)) || (cp >= 0xD800 && cp <= 0xDFFF))
+    return 0;
+  return len;
+}
+
+bool valid_utf8(std::string_view input) {
+  auto it  = (unsigned char const *)input.data();
+  auto end = it + input.size();
+  while (it != end)
+    if (auto len = utf8_sequence(it, end))
+      it += len;
+    else
+      return false;
+  return true;
+}
+
+// replaces every malformed byte with U+FFFD in ret, for clients that only understand text;
+// valid input is scanned once and nothing is copied, in which case it returns false and leaves ret untouched
+bool sanitize_utf8(std::string_view input, std::string &ret) {
+  auto begin = (unsigned char const *)input.data();
+  auto end   = begin + input.size();
+  auto it    = begin;
+  while (it != end)
+    if (auto len = utf8_sequence(it, end))
+      it += len;
+    else
+      break;
+  if (it == end) return false;
+  ret.assign((char const *)begin, it - begin);
+  while (it != end)
+    if (auto len = utf8_sequence(it, end)) {
+      ret.append((char const *)it, len);
+      it += len;
+    } else {
+      ret += "\xEF\xBF\xBD";
+      it++;
+    }
+  return true;
+}
+
+// length of a multi-byte sequence that was cut off at the end of input and can be completed by the next read
+size_t utf8_incomplete_tail(std::string_view input) {
+  for (size_t i = 1; i <= 3 && i <= input.size(); i++) {
+    unsigned char ch = input[input.size() - i];
+    if ((ch & 0xC0) == 0x80) continue;
+    size_t len = (ch & 0xF8) == 0xF0 ? 4 : (ch & 0xF0) == 0xE0 ? 3 : (ch & 0xE0) == 0xC0 ? 2 : 1;
+    return len > i ? i : 0;
+  }
+  return 0;
+}
+
+// binary-safe payload encoding used by send and by nsctl for binary_output: plain strings when they are valid utf-8, tagged base64 otherwise
+void put_payload(rpc::json &j, std::string_view data) {
+  if (valid_utf8(data))
+    j["data"] = std::string{ data };
+  else {
+    j["data"]     = base64_encode(data);
+    j["encoding"] = "base64";
+  }
+}
+
+std::string get_payload(rpc::json const &j) {
+  auto data = j.at("data").get<std::string>();
+  if (j.value("encoding", "") == "base64") return base64_decode(data);
+  return data;
+}